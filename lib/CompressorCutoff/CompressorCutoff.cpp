@@ -0,0 +1,126 @@
+//
+// Predictive compressor cutoff.
+//
+
+#include "CompressorCutoff.h"
+
+// How much each new sample affects the fill rate estimate (0-1). Lower is smoother but slower to react.
+const float fill_rate_smoothing = 0.15;
+
+// How much each measured cutoff affects the lag estimate (0-1)
+const float cutoff_lag_learning_rate = 0.3;
+// Bounds on the learned lag so one bad measurement can't make the cutoff unreasonable
+const float cutoff_lag_min_s = 0.0;
+const float cutoff_lag_max_s = 1.0;
+// Fill rates below this in PSI/s are too noisy to learn the lag from
+const float cutoff_lag_min_fill_rate = 1.0;
+// How long after a cutoff to wait for the pressure to settle before measuring the overshoot
+const unsigned long cutoff_settle_ms = 500;
+
+
+void CompressorCutoff::begin_charging(unsigned long now_ms) {
+    seeded_ = false;
+    fill_rate_valid_ = false;
+    fill_rate_ = 0;
+    measuring_overshoot_ = false;
+    charge_start_ms_ = now_ms;
+}
+
+void CompressorCutoff::add_sample(float psi, unsigned long now_ms, bool charging) {
+    // The first sample only seeds the estimator, otherwise it would look like the tank filling from 0
+    if (!seeded_) {
+        seeded_ = true;
+        last_pressure_ = psi;
+        last_sample_ms_ = now_ms;
+        return;
+    }
+
+    unsigned long dt_ms = now_ms - last_sample_ms_;
+
+    // Two samples in the same millisecond can't give a rate
+    if (dt_ms == 0) {
+        return;
+    }
+
+    float sample_rate = (psi - last_pressure_) * 1000.0 / dt_ms;
+
+    last_pressure_ = psi;
+    last_sample_ms_ = now_ms;
+
+    // The compressors can't empty the tank, so while charging a falling sample is just noise.
+    if (charging && sample_rate < 0) {
+        return;
+    }
+
+    // Start from the first measured rate instead of smoothing up from 0
+    if (!fill_rate_valid_) {
+        fill_rate_ = sample_rate;
+        fill_rate_valid_ = true;
+    }
+    else {
+        fill_rate_ += fill_rate_smoothing * (sample_rate - fill_rate_);
+    }
+}
+
+float CompressorCutoff::predicted_settled_pressure() const {
+    // The tank can't empty itself because the compressors switched off, so ignore a falling pressure.
+    if (fill_rate_ <= 0) {
+        return last_pressure_;
+    }
+    return last_pressure_ + fill_rate_ * cutoff_lag_s_;
+}
+
+bool CompressorCutoff::should_stop_charging(float target_psi) const {
+    return last_pressure_ >= target_psi || predicted_settled_pressure() >= target_psi;
+}
+
+void CompressorCutoff::begin_overshoot_measurement(unsigned long now_ms) {
+    measuring_overshoot_ = true;
+    cutoff_time_ms_ = now_ms;
+    cutoff_pressure_ = last_pressure_;
+    cutoff_fill_rate_ = fill_rate_;
+    peak_pressure_ = last_pressure_;
+    peak_time_ms_ = now_ms;
+}
+
+bool CompressorCutoff::update_overshoot_measurement(unsigned long now_ms, bool charged, float target_psi) {
+    if (!measuring_overshoot_) {
+        return false;
+    }
+
+    // Firing or canceling releases air, so the peak would no longer be meaningful.
+    if (!charged) {
+        measuring_overshoot_ = false;
+        return false;
+    }
+
+    if (last_pressure_ > peak_pressure_) {
+        peak_pressure_ = last_pressure_;
+        peak_time_ms_ = now_ms;
+    }
+
+    if (now_ms - cutoff_time_ms_ < cutoff_settle_ms) {
+        return false;
+    }
+    measuring_overshoot_ = false;
+
+    settling_error_ = peak_pressure_ - target_psi;
+    time_to_target_ms_ = peak_time_ms_ - charge_start_ms_;
+
+    if (cutoff_fill_rate_ < cutoff_lag_min_fill_rate) {
+        return true;
+    }
+
+    // overshoot = fill rate * lag, so the observed overshoot gives the lag that would have landed on target.
+    float measured_lag = (peak_pressure_ - cutoff_pressure_) / cutoff_fill_rate_;
+    cutoff_lag_s_ += cutoff_lag_learning_rate * (measured_lag - cutoff_lag_s_);
+
+    if (cutoff_lag_s_ < cutoff_lag_min_s) {
+        cutoff_lag_s_ = cutoff_lag_min_s;
+    }
+    if (cutoff_lag_s_ > cutoff_lag_max_s) {
+        cutoff_lag_s_ = cutoff_lag_max_s;
+    }
+
+    return true;
+}
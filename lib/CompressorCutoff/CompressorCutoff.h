@@ -0,0 +1,95 @@
+//
+// Predictive compressor cutoff.
+//
+// The pressure in the tank keeps rising for a while after the relays switch off. This estimates the fill rate from
+// the pressure samples and switches the compressors off early enough that the tank settles on the target instead of
+// overshooting it. The lag is learned from the overshoot measured after every cutoff.
+//
+// Has no Arduino dependencies so it can be tested on the host.
+//
+
+#ifndef COMPRESSOR_CUTOFF_H
+#define COMPRESSOR_CUTOFF_H
+
+class CompressorCutoff {
+public:
+    /**
+     * Start over for a new charge. The fill rate from before is forgotten, since a shot or cancel makes it very
+     * negative.
+     * @param now_ms The current time in milliseconds.
+     */
+    void begin_charging(unsigned long now_ms);
+
+    /**
+     * Update the fill rate estimate with the latest pressure sample.
+     * @param psi The current pressure in the air tank in PSI.
+     * @param now_ms The time the sample was taken in milliseconds.
+     * @param charging Whether or not the compressors are running.
+     */
+    void add_sample(float psi, unsigned long now_ms, bool charging);
+
+    /**
+     * Predict the pressure the tank will settle at if the compressors are switched off now.
+     * @return The predicted pressure in PSI.
+     */
+    float predicted_settled_pressure() const;
+
+    /**
+     * Whether or not the compressors should be switched off so the tank lands on the target pressure.
+     * @param target_psi The pressure to stop at in PSI.
+     */
+    bool should_stop_charging(float target_psi) const;
+
+    /**
+     * Start measuring how far the pressure rises after the compressors were switched off.
+     * @param now_ms The time the compressors were switched off in milliseconds.
+     */
+    void begin_overshoot_measurement(unsigned long now_ms);
+
+    /**
+     * Track the pressure after a cutoff. Once it has settled, use the measured overshoot to correct the lag estimate.
+     * @param now_ms The current time in milliseconds.
+     * @param charged Whether or not the tank is still holding its charge. Firing or canceling abandons the measurement.
+     * @param target_psi The pressure that was being charged to in PSI.
+     * @return Whether or not a measurement finished on this call.
+     */
+    bool update_overshoot_measurement(unsigned long now_ms, bool charged, float target_psi);
+
+    /** Smoothed rate at which the pressure is rising in PSI/s */
+    float fill_rate() const { return fill_rate_; }
+
+    /** Estimated time in seconds the pressure keeps rising after the relays switch off */
+    float cutoff_lag_s() const { return cutoff_lag_s_; }
+
+    /** How far the last charge settled above the target in PSI. Negative if it fell short. */
+    float settling_error() const { return settling_error_; }
+
+    /** Time from the start of the last charge until the pressure settled in milliseconds */
+    unsigned long time_to_target_ms() const { return time_to_target_ms_; }
+
+private:
+    // The pressure and time of the previous sample
+    float last_pressure_ = 0;
+    unsigned long last_sample_ms_ = 0;
+    // Whether or not there is a previous sample to estimate a rate from
+    bool seeded_ = false;
+    // Whether or not fill_rate_ holds a measured rate yet
+    bool fill_rate_valid_ = false;
+    float fill_rate_ = 0;
+
+    float cutoff_lag_s_ = 0.15;
+
+    // Overshoot measurement of the most recent cutoff
+    bool measuring_overshoot_ = false;
+    unsigned long charge_start_ms_ = 0;
+    unsigned long cutoff_time_ms_ = 0;
+    float cutoff_pressure_ = 0;
+    float cutoff_fill_rate_ = 0;
+    float peak_pressure_ = 0;
+    unsigned long peak_time_ms_ = 0;
+
+    float settling_error_ = 0;
+    unsigned long time_to_target_ms_ = 0;
+};
+
+#endif //COMPRESSOR_CUTOFF_H
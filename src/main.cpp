@@ -7,6 +7,7 @@
 #include <Adafruit_GFX.h>
 #include <Adafruit_SH110X.h>
 #include <stdlib.h>
+#include <CompressorCutoff.h>
 //#include "../.pio/libdeps/uno/Adafruit SH110X/Adafruit_SH110X.h"
 
 
@@ -44,6 +45,11 @@
 #define DEBUG_PRINTLN(x) do {} while (0)
 #endif
 
+// Shot capture export
+// Uncomment to dump the raw pressure samples of every shot over serial for offline analysis.
+// Relays B and C share the serial pins, so only use this on the bench.
+//#define SHOT_CAPTURE_EXPORT
+
 
 
 /*
@@ -90,6 +96,11 @@ const int relay_A_pin = 5;
 const int relay_B_pin = 0;
 const int relay_C_pin = 1;
 
+// Valves
+// Both valves are currently wired to the built-in LED until the solenoids are connected.
+const int firing_valve_pin = LED_BUILTIN;
+const int cancel_valve_pin = LED_BUILTIN;
+
 // ========== State setup ==============================================================================================
 // Firing
 
@@ -122,6 +133,15 @@ const float transducer_offset = 0.4834;
 
 
 
+// Compressor cutoff
+
+// The current pressure in the air tank in PSI, without rounding to a whole PSI
+float pressure_precise = 0;
+// Estimates the fill rate and decides when to switch the compressors off so the tank lands on the target pressure
+CompressorCutoff compressor_cutoff;
+
+
+
 // Ammo counter
 
 // The currently selected magazine size
@@ -142,6 +162,100 @@ byte magazine_button_current_state = 0;
 
 
 
+// Valve pulses
+
+// Timer1 runs at 16 MHz / 64, so one tick is 4 microseconds and the longest single phase is about 262 ms.
+#define VALVE_TIMER_US_PER_TICK 4
+#define VALVE_TIMER_MAX_TICKS 65535
+
+// Output register and bit mask of the valve currently being pulsed. Cached so the ISR doesn't need digitalWrite().
+volatile uint8_t *valve_pulse_port = NULL;
+volatile uint8_t valve_pulse_mask = 0;
+// Length of the open and closed phases of the current pulse train in timer ticks
+volatile uint16_t valve_pulse_open_ticks = 0;
+volatile uint16_t valve_pulse_gap_ticks = 0;
+// How many more times the valve will open after the current phase
+volatile byte valve_pulses_remaining = 0;
+// Whether or not the valve is currently open
+volatile byte valve_open = 0;
+// Whether or not a pulse train is in progress
+volatile byte valve_pulse_busy = 0;
+
+// Dwell calibration curve. The higher the pressure, the less time the pilot valve needs to be open to dump the tank.
+// Pressures in PSI must be increasing. Dwell times in microseconds.
+const byte valve_dwell_curve_pressure[] = {  0,    10,    25,    50,    75,   100};
+const uint32_t valve_dwell_curve_us[] =    {60000, 60000, 40000, 25000, 18000, 15000};
+const byte valve_dwell_curve_length = sizeof(valve_dwell_curve_pressure) / sizeof(valve_dwell_curve_pressure[0]);
+
+// Vent pulses used when canceling a shot
+const uint32_t cancel_vent_pulse_us = 100000;
+const uint32_t cancel_vent_gap_us = 100000;
+const byte cancel_vent_pulse_count = 2;
+
+
+
+// Shot capture
+
+// The ADC free-runs at 16 MHz / 32 during a capture and each conversion takes 13 ADC clocks.
+#define SHOT_CAPTURE_CONVERSION_RATE_HZ 38462
+// Conversions are averaged into samples. Short dwells use the fewest conversions per sample (12.8 kHz), longer dwells
+// use more so the whole pulse still fits in the buffer. The sum of 64 10-bit conversions still fits in 16 bits.
+#define SHOT_CAPTURE_MIN_CONVERSIONS_PER_SAMPLE 3
+#define SHOT_CAPTURE_MAX_CONVERSIONS_PER_SAMPLE 64
+// The samples are recorded into the display buffer, which isn't needed while a shot is being captured, so the capture
+// doesn't take any SRAM of its own. Only the top 8 bits of each sample are kept.
+#define SHOT_CAPTURE_BUFFER_SIZE (SCREEN_WIDTH * ((SCREEN_HEIGHT + 7) / 8))
+// Samples taken before the valve opens, used as the baseline pressure
+#define SHOT_CAPTURE_PRE_TRIGGER_SAMPLES 16
+// How long to keep recording after the valve closes so the pressure can settle
+#define SHOT_CAPTURE_TAIL_US 3000
+
+// Number of samples needed to record a valve pulse and the tail after it at the given sample rate
+#define SHOT_CAPTURE_SAMPLES_FOR_US(us, rate_hz) (SHOT_CAPTURE_PRE_TRIGGER_SAMPLES + \
+    ((uint32_t)(us) + SHOT_CAPTURE_TAIL_US) * (rate_hz) / 1000000UL + 1)
+
+/*
+  capture_idle is when no capture is in progress
+  capture_running is when the ADC is filling the buffer
+  capture_done is when the buffer is full and waiting to be summarized
+*/
+enum shot_capture_status { capture_idle, capture_running, capture_done };
+volatile enum shot_capture_status shot_capture_state = capture_idle;
+
+// Raw transducer samples of the most recent shot. Points at the display buffer, NULL if it couldn't be allocated.
+volatile byte *shot_capture_buffer = NULL;
+volatile uint16_t shot_capture_index = 0;
+// Number of samples to record for the current shot, which depends on the dwell
+volatile uint16_t shot_capture_length = 0;
+// Conversions accumulated towards the next sample
+volatile uint16_t shot_capture_sum = 0;
+volatile byte shot_capture_conversions = 0;
+// Sample rate of the current shot, which depends on the dwell
+volatile byte shot_capture_conversions_per_sample = SHOT_CAPTURE_MIN_CONVERSIONS_PER_SAMPLE;
+uint16_t shot_capture_sample_rate_hz = SHOT_CAPTURE_CONVERSION_RATE_HZ / SHOT_CAPTURE_MIN_CONVERSIONS_PER_SAMPLE;
+// The valve pulse started by the capture once the pre-trigger window is full
+int shot_capture_valve_pin = 0;
+uint32_t shot_capture_dwell_us = 0;
+// Whether or not the capture actually opened the valve
+volatile byte shot_capture_valve_opened = 0;
+
+// Summary of the most recent shot
+// Average pressure before the valve opened in PSI
+float shot_baseline_pressure = 0;
+// Highest pressure seen during the capture in PSI
+float shot_peak_pressure = 0;
+// How far the pressure fell from the pre-trigger baseline in PSI
+float shot_pressure_drop = 0;
+// Time from the valve opening until 90% of the drop had happened in microseconds
+uint32_t shot_time_to_empty_us = 0;
+
+// The smallest drop, as a fraction of the pressure before the shot, that counts as the gun actually firing
+const float shot_min_pressure_drop_fraction = 0.5;
+// Below this pressure in PSI a shot can't be told apart from noise, so it is always counted
+const float shot_detection_min_baseline_psi = 5.0;
+
+
+
 // ========== i2c Multiplexer Functions ================================================================================
 /**
  * Set the i2c multiplexer to the specified bus
@@ -196,6 +310,11 @@ void boot_animation(void) {
  * Updates the ammo counter display
  */
 void update_ammo_display() {
+    // The display buffer is holding a shot capture
+    if (shot_capture_state != capture_idle) {
+        return;
+    }
+
     // Select the ammo display on the i2c multiplexer
     tcaselect(ammo_display_i2c_multiplexer_bus);
 
@@ -406,6 +525,11 @@ void display_pressure_bar() {
  * Updates the pressure display
  */
 void update_pressure_display() {
+    // The display buffer is holding a shot capture
+    if (shot_capture_state != capture_idle) {
+        return;
+    }
+
     // Select the ammo display on the i2c multiplexer
     tcaselect(pressure_display_i2c_multiplexer_bus);
 
@@ -437,6 +561,379 @@ void update_pressure_display() {
 }
 
 
+// ========== Valve Pulse Functions ====================================================================================
+/**
+ * Configure Timer1 to generate valve pulses. The timer is left stopped until a pulse is started.
+ */
+void init_valve_timer() {
+    noInterrupts();
+    TCCR1A = 0;
+    // CTC mode, clock stopped
+    TCCR1B = (1 << WGM12);
+    TCNT1 = 0;
+    TIMSK1 = 0;
+    interrupts();
+}
+
+/**
+ * Convert a duration to Timer1 ticks, clamped to what fits in one compare match.
+ * @param us The duration in microseconds.
+ */
+uint16_t valve_us_to_ticks(uint32_t us) {
+    uint32_t ticks = us / VALVE_TIMER_US_PER_TICK;
+    if (ticks < 1) {
+        ticks = 1;
+    }
+    if (ticks > VALVE_TIMER_MAX_TICKS) {
+        ticks = VALVE_TIMER_MAX_TICKS;
+    }
+    return (uint16_t)ticks;
+}
+
+/**
+ * Restart Timer1 so that the compare match fires after the given number of ticks.
+ * Must be called with interrupts disabled.
+ */
+void schedule_valve_timer(uint16_t ticks) {
+    // Stop the clock while reprogramming
+    TCCR1B = (1 << WGM12);
+    TCNT1 = 0;
+    OCR1A = ticks - 1;
+    // Clear any pending compare match before enabling the interrupt
+    TIFR1 = (1 << OCF1A);
+    TIMSK1 |= (1 << OCIE1A);
+    // Start the clock with a /64 prescaler
+    TCCR1B = (1 << WGM12) | (1 << CS11) | (1 << CS10);
+}
+
+/**
+ * Stop Timer1 and close the valve.
+ * Must be called with interrupts disabled.
+ */
+void stop_valve_timer() {
+    TCCR1B = (1 << WGM12);
+    TIMSK1 &= ~(1 << OCIE1A);
+    if (valve_pulse_port != NULL) {
+        *valve_pulse_port &= ~valve_pulse_mask;
+    }
+    valve_open = 0;
+    valve_pulses_remaining = 0;
+    valve_pulse_busy = 0;
+}
+
+/**
+ * Open a valve for a precise amount of time without blocking the loop.
+ * Any pulse train already in progress is cut short and its valve closed.
+ * @param pin The pin the valve is connected to.
+ * @param open_us How long the valve is held open for each pulse, in microseconds.
+ * @param count How many pulses to generate.
+ * @param gap_us How long the valve is held closed between pulses, in microseconds.
+ */
+void start_valve_pulse(int pin, uint32_t open_us, byte count, uint32_t gap_us) {
+    if (count == 0) {
+        return;
+    }
+
+    uint8_t oldSREG = SREG;
+    noInterrupts();
+
+    stop_valve_timer();
+
+    valve_pulse_port = portOutputRegister(digitalPinToPort(pin));
+    valve_pulse_mask = digitalPinToBitMask(pin);
+    valve_pulse_open_ticks = valve_us_to_ticks(open_us);
+    valve_pulse_gap_ticks = valve_us_to_ticks(gap_us);
+    valve_pulses_remaining = count - 1;
+    valve_pulse_busy = 1;
+
+    // Open the valve and let the timer close it
+    *valve_pulse_port |= valve_pulse_mask;
+    valve_open = 1;
+    schedule_valve_timer(valve_pulse_open_ticks);
+
+    SREG = oldSREG;
+}
+
+/**
+ * Ends the current phase of the pulse train. Closes the valve after an open phase and reopens it after a gap if there
+ * are pulses remaining.
+ */
+ISR(TIMER1_COMPA_vect) {
+    if (valve_open) {
+        *valve_pulse_port &= ~valve_pulse_mask;
+        valve_open = 0;
+
+        if (valve_pulses_remaining > 0) {
+            schedule_valve_timer(valve_pulse_gap_ticks);
+        }
+        else {
+            stop_valve_timer();
+        }
+    }
+    else {
+        *valve_pulse_port |= valve_pulse_mask;
+        valve_open = 1;
+        valve_pulses_remaining--;
+        schedule_valve_timer(valve_pulse_open_ticks);
+    }
+}
+
+/**
+ * Look up how long the firing valve should be opened for at the given pressure.
+ * Linearly interpolates between the points of the dwell calibration curve.
+ * @param psi The current pressure in the air tank in PSI.
+ * @return The dwell time in microseconds.
+ */
+uint32_t pressure_to_dwell_us(byte psi) {
+    if (psi <= valve_dwell_curve_pressure[0]) {
+        return valve_dwell_curve_us[0];
+    }
+
+    for (byte i = 1; i < valve_dwell_curve_length; i++) {
+        if (psi <= valve_dwell_curve_pressure[i]) {
+            byte p0 = valve_dwell_curve_pressure[i - 1];
+            byte p1 = valve_dwell_curve_pressure[i];
+            int32_t d0 = valve_dwell_curve_us[i - 1];
+            int32_t d1 = valve_dwell_curve_us[i];
+            return (uint32_t)(d0 + (d1 - d0) * (int32_t)(psi - p0) / (int32_t)(p1 - p0));
+        }
+    }
+
+    // Past the end of the curve
+    return valve_dwell_curve_us[valve_dwell_curve_length - 1];
+}
+
+
+
+// ========== Pressure Transducer Functions ============================================================================
+
+float voltage_to_pressure_psi_precise(double voltage) {
+    // The pressure transducer outputs 0.5 V at 0 PSI and 4.5 V at 150 PSI.
+    // Subtracting the offset gives us a range of 0-4 V == 0-150 PSI.
+    return (voltage - transducer_offset) * (TRANSDUCER_MAX_PRESSURE_PSI / 4.00);
+}
+
+byte voltage_to_pressure_psi(double voltage) {
+    return (byte)voltage_to_pressure_psi_precise(voltage);
+}
+
+void update_pressure(int signal) {
+    // Analog signals are a range from 0-1023, representing 0-5 volts.
+    double voltage =  signal * 5.00 / 1024;
+    pressure = voltage_to_pressure_psi(voltage);
+    pressure_precise = voltage_to_pressure_psi_precise(voltage);
+    if (pressure < 0) {
+        // If the transducer is calibrated correctly this should never happen, but just in case.
+        pressure = 0;
+    }
+}
+
+
+
+// ========== Shot Capture Functions ===================================================================================
+/**
+ * Convert an 8-bit capture sample to a pressure.
+ * @param sample The top 8 bits of the averaged ADC conversions of the transducer.
+ * @return The pressure in PSI.
+ */
+float capture_sample_to_pressure_psi(byte sample) {
+    // 8-bit samples are a range from 0-255, representing 0-5 volts.
+    return voltage_to_pressure_psi_precise(sample * 5.00 / 256);
+}
+
+/**
+ * Record the pressure transducer at high speed around a valve pulse. The ADC fills the pre-trigger window first, then
+ * opens the valve and keeps sampling until a short time after it closes.
+ * analogRead() must not be used while the capture is running.
+ * @param valve_pin The pin of the valve to open.
+ * @param dwell_us How long to open the valve for in microseconds.
+ */
+void start_shot_capture(int valve_pin, uint32_t dwell_us) {
+    // Use the fastest sample rate that still fits the whole pulse in the buffer
+    byte conversions_per_sample = SHOT_CAPTURE_MIN_CONVERSIONS_PER_SAMPLE;
+    uint32_t length = SHOT_CAPTURE_SAMPLES_FOR_US(dwell_us, SHOT_CAPTURE_CONVERSION_RATE_HZ / conversions_per_sample);
+    while (length > SHOT_CAPTURE_BUFFER_SIZE && conversions_per_sample < SHOT_CAPTURE_MAX_CONVERSIONS_PER_SAMPLE) {
+        conversions_per_sample++;
+        length = SHOT_CAPTURE_SAMPLES_FOR_US(dwell_us, SHOT_CAPTURE_CONVERSION_RATE_HZ / conversions_per_sample);
+    }
+    // The recording stops when the buffer is full. This never cuts the valve pulse short.
+    if (length > SHOT_CAPTURE_BUFFER_SIZE) {
+        length = SHOT_CAPTURE_BUFFER_SIZE;
+    }
+
+    uint8_t oldSREG = SREG;
+    noInterrupts();
+
+    shot_capture_valve_pin = valve_pin;
+    shot_capture_dwell_us = dwell_us;
+    shot_capture_index = 0;
+    shot_capture_sum = 0;
+    shot_capture_conversions = 0;
+    shot_capture_valve_opened = 0;
+    shot_capture_conversions_per_sample = conversions_per_sample;
+    shot_capture_sample_rate_hz = SHOT_CAPTURE_CONVERSION_RATE_HZ / conversions_per_sample;
+    shot_capture_length = length;
+    shot_capture_state = capture_running;
+
+    // AVcc reference, right adjusted 10-bit result
+    ADMUX = (1 << REFS0) | ((pressure_transducer_pin - A0) & 0x07);
+    // Free running trigger source
+    ADCSRB = 0;
+    // Enable, start, auto trigger, interrupt, /32 prescaler. Writing ADIF clears any stale conversion.
+    ADCSRA = (1 << ADEN) | (1 << ADSC) | (1 << ADATE) | (1 << ADIF) | (1 << ADIE) | (1 << ADPS2) | (1 << ADPS0);
+
+    SREG = oldSREG;
+}
+
+/**
+ * Put the ADC back how analogRead() expects it.
+ * Must be called with interrupts disabled.
+ */
+void stop_shot_capture_adc() {
+    // Enable, /128 prescaler, no auto trigger or interrupt
+    ADCSRA = (1 << ADEN) | (1 << ADIF) | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0);
+}
+
+/**
+ * Average the conversions of the capture into samples. Opens the valve when the pre-trigger window is full, unless
+ * another pulse train such as a cancel vent is still running.
+ */
+ISR(ADC_vect) {
+    shot_capture_sum += ADC;
+    shot_capture_conversions++;
+    if (shot_capture_conversions < shot_capture_conversions_per_sample) {
+        return;
+    }
+
+    // Average the 10-bit conversions and keep the top 8 bits
+    shot_capture_buffer[shot_capture_index] = shot_capture_sum / (shot_capture_conversions_per_sample * 4);
+    shot_capture_sum = 0;
+    shot_capture_conversions = 0;
+    shot_capture_index++;
+
+    if (shot_capture_index == SHOT_CAPTURE_PRE_TRIGGER_SAMPLES) {
+        // Starting a pulse would cut the running train short
+        if (!valve_pulse_busy) {
+            start_valve_pulse(shot_capture_valve_pin, shot_capture_dwell_us, 1, 0);
+            shot_capture_valve_opened = 1;
+        }
+    }
+    if (shot_capture_index >= shot_capture_length) {
+        stop_shot_capture_adc();
+        shot_capture_state = capture_done;
+    }
+}
+
+/**
+ * Calculate the peak pressure, pressure drop and time-to-empty of the captured shot.
+ */
+void summarize_shot_capture() {
+    // Baseline is the average pressure before the valve opened
+    uint16_t baseline_sum = 0;
+    byte peak = 0;
+    for (uint16_t i = 0; i < SHOT_CAPTURE_PRE_TRIGGER_SAMPLES; i++) {
+        baseline_sum += shot_capture_buffer[i];
+        if (shot_capture_buffer[i] > peak) {
+            peak = shot_capture_buffer[i];
+        }
+    }
+    byte baseline = baseline_sum / SHOT_CAPTURE_PRE_TRIGGER_SAMPLES;
+    shot_baseline_pressure = capture_sample_to_pressure_psi(baseline);
+
+    byte lowest = 255;
+    for (uint16_t i = SHOT_CAPTURE_PRE_TRIGGER_SAMPLES; i < shot_capture_length; i++) {
+        if (shot_capture_buffer[i] > peak) {
+            peak = shot_capture_buffer[i];
+        }
+        if (shot_capture_buffer[i] < lowest) {
+            lowest = shot_capture_buffer[i];
+        }
+    }
+
+    shot_peak_pressure = capture_sample_to_pressure_psi(peak);
+    shot_pressure_drop = shot_baseline_pressure - capture_sample_to_pressure_psi(lowest);
+    if (shot_pressure_drop < 0) {
+        shot_pressure_drop = 0;
+    }
+
+    // Find when 90% of the drop had happened. Compared in raw samples so the loop doesn't need floating point.
+    shot_time_to_empty_us = 0;
+    if (lowest >= baseline) {
+        return;
+    }
+    byte empty_sample = baseline - (9 * (baseline - lowest) + 5) / 10;
+    for (uint16_t i = SHOT_CAPTURE_PRE_TRIGGER_SAMPLES; i < shot_capture_length; i++) {
+        if (shot_capture_buffer[i] <= empty_sample) {
+            uint32_t samples = i - SHOT_CAPTURE_PRE_TRIGGER_SAMPLES;
+            shot_time_to_empty_us = samples * 1000000UL / shot_capture_sample_rate_hz;
+            break;
+        }
+    }
+}
+
+/**
+ * Dump the raw capture and its summary over serial as comma separated values.
+ */
+void export_shot_capture() {
+#ifdef SHOT_CAPTURE_EXPORT
+    Serial.print(F("shot,"));
+    Serial.print(shot_capture_sample_rate_hz);
+    Serial.print(',');
+    Serial.print(SHOT_CAPTURE_PRE_TRIGGER_SAMPLES);
+    Serial.print(',');
+    Serial.println(shot_capture_length);
+
+    for (uint16_t i = 0; i < shot_capture_length; i++) {
+        Serial.print(shot_capture_buffer[i]);
+        Serial.print(i < shot_capture_length - 1 ? ',' : '\n');
+    }
+
+    Serial.print(F("summary,"));
+    Serial.print(shot_peak_pressure);
+    Serial.print(',');
+    Serial.print(shot_pressure_drop);
+    Serial.print(',');
+    Serial.println(shot_time_to_empty_us);
+#endif
+}
+
+/**
+ * Handle a finished capture. Only counts the shot against the ammo if the pressure actually dropped.
+ */
+void process_shot_capture() {
+    summarize_shot_capture();
+    export_shot_capture();
+
+    DEBUG_PRINT("Shot peak (PSI): ");
+    DEBUG_PRINTLN(shot_peak_pressure);
+    DEBUG_PRINT("Shot drop (PSI): ");
+    DEBUG_PRINTLN(shot_pressure_drop);
+    DEBUG_PRINT("Shot time to empty (us): ");
+    DEBUG_PRINTLN(shot_time_to_empty_us);
+
+    // Hand the buffer back to the displays before the ammo counter is redrawn
+    display.clearDisplay();
+    shot_capture_state = capture_idle;
+
+    if (!shot_capture_valve_opened) {
+        DEBUG_PRINTLN("Valve busy, shot not fired");
+    }
+    else if (shot_baseline_pressure < shot_detection_min_baseline_psi) {
+        DEBUG_PRINTLN("Pressure too low to detect a discharge, counting the shot");
+        // Update ammo counter
+        reduce_current_ammo();
+    }
+    else if (shot_pressure_drop >= shot_baseline_pressure * shot_min_pressure_drop_fraction) {
+        // Update ammo counter
+        reduce_current_ammo();
+    }
+    else {
+        DEBUG_PRINTLN("No discharge detected");
+    }
+}
+
+
+
 // ========== Setup ====================================================================================================
 /**
  * Initialize everything necessary when the Arduino boots up.
@@ -444,6 +941,9 @@ void update_pressure_display() {
 void setup() {
     // Set up serial monitoring
     //Serial.begin(9600);
+#ifdef SHOT_CAPTURE_EXPORT
+    Serial.begin(115200);
+#endif
 
 
 
@@ -460,6 +960,9 @@ void setup() {
     tcaselect(pressure_display_i2c_multiplexer_bus);
     display.begin(oled_display_i2c_address, true);
 
+    // Shots are recorded into the display buffer. NULL if it couldn't be allocated.
+    shot_capture_buffer = display.getBuffer();
+
     // Display a cool animation while the gun initializes
     boot_animation();
     display.display();
@@ -471,7 +974,8 @@ void setup() {
 
     // Firing
     pinMode(trigger_switch_pin, INPUT_PULLUP);
-    pinMode(LED_BUILTIN, OUTPUT);
+    pinMode(firing_valve_pin, OUTPUT);
+    pinMode(cancel_valve_pin, OUTPUT);
     pinMode(cancel_button_pin, INPUT_PULLUP);
 
     // Pressure
@@ -501,6 +1005,11 @@ void setup() {
     digitalWrite(relay_B_pin, LOW);
     digitalWrite(relay_C_pin, LOW);
 
+    // Valves
+    digitalWrite(firing_valve_pin, LOW);
+    digitalWrite(cancel_valve_pin, LOW);
+    init_valve_timer();
+
 
     // Configure ammo encoder interrupts
     attachInterrupt(digitalPinToInterrupt(ammo_encoder_clk_pin), update_ammo_encoder, CHANGE);
@@ -511,18 +1020,35 @@ void setup() {
 
 // ========== Gun Functions ============================================================================================
 /**
- * Fire the gun by opening the pilot solenoid valve
+ * Whether or not the gun can fire right now. A shot has to wait until the previous one has been recorded and any vent
+ * pulses have finished.
+ */
+byte ready_to_fire() {
+    return shot_capture_state == capture_idle && !valve_pulse_busy;
+}
+
+/**
+ * Fire the gun by opening the pilot solenoid valve. Only call this when ready_to_fire().
  */
 void fire() {
     DEBUG_PRINTLN("Firing");
 
-    // Fire gun
-    digitalWrite(LED_BUILTIN, HIGH);
-    delay(100);
-    digitalWrite(LED_BUILTIN, LOW);
+    // Fire gun. The dwell time depends on the pressure, higher pressures need a shorter pulse to empty the tank.
+    uint32_t dwell_us = pressure_to_dwell_us(pressure);
+    DEBUG_PRINT("Dwell (us): ");
+    DEBUG_PRINTLN(dwell_us);
+
+    // Without a display buffer there is nowhere to record the shot, so just fire it and count it.
+    if (shot_capture_buffer == NULL) {
+        DEBUG_PRINTLN("No display buffer, firing without capture");
+        start_valve_pulse(firing_valve_pin, dwell_us, 1, 0);
+        reduce_current_ammo();
+        return;
+    }
 
-    // Update ammo counter
-    reduce_current_ammo();
+    // The capture opens the valve once it has recorded the pressure before the shot. The ammo counter is updated when
+    // the capture finishes, if the shot really happened.
+    start_shot_capture(firing_valve_pin, dwell_us);
 }
 
 /**
@@ -530,13 +1056,7 @@ void fire() {
  */
 void cancel() {
     DEBUG_PRINTLN("Canceling");
-    digitalWrite(LED_BUILTIN, HIGH);
-    delay(100);
-    digitalWrite(LED_BUILTIN, LOW);
-    delay(100);
-    digitalWrite(LED_BUILTIN, HIGH);
-    delay(100);
-    digitalWrite(LED_BUILTIN, LOW);
+    start_valve_pulse(cancel_valve_pin, cancel_vent_pulse_us, cancel_vent_pulse_count, cancel_vent_gap_us);
 }
 
 
@@ -580,25 +1100,6 @@ void update_target_pressure(int signal) {
 }
 
 
-// ========== Pressure Transducer Functions ============================================================================
-
-byte voltage_to_pressure_psi(double voltage) {
-    // The pressure transducer outputs 0.5 V at 0 PSI and 4.5 V at 150 PSI.
-    // Subtracting the offset gives us a range of 0-4 V == 0-150 PSI.
-    return (byte)((voltage - transducer_offset) * (TRANSDUCER_MAX_PRESSURE_PSI / 4.00));
-}
-
-void update_pressure(int signal) {
-    // Analog signals are a range from 0-1023, representing 0-5 volts.
-    double voltage =  signal * 5.00 / 1024;
-    pressure = voltage_to_pressure_psi(voltage);
-    if (pressure < 0) {
-        // If the transducer is calibrated correctly this should never happen, but just in case.
-        pressure = 0;
-    }
-}
-
-
 // ========== Main Loop ================================================================================================
 /**
  * Main loop of the program.
@@ -609,10 +1110,19 @@ void loop() {
     cancel_state = digitalRead(cancel_button_pin);
     limiter_switch_current_state = digitalRead(limiter_switch_pin);
     magazine_button_current_state = digitalRead(magazine_button_pin);
-    // Read the pressure in the tank.
-    update_pressure(analogRead(pressure_transducer_pin));
-    // Read the pressure the pressure selector is set to
-    update_target_pressure(analogRead(pressure_select_pot_pin));
+    // The ADC is busy while a shot is being captured, so keep the last readings until it is done.
+    if (shot_capture_state != capture_running) {
+        // Read the pressure in the tank.
+        update_pressure(analogRead(pressure_transducer_pin));
+        compressor_cutoff.add_sample(pressure_precise, millis(), fire_state == charging);
+        // Read the pressure the pressure selector is set to
+        update_target_pressure(analogRead(pressure_select_pot_pin));
+    }
+
+    // ========== Shot capture =========================================================================================
+    if (shot_capture_state == capture_done) {
+        process_shot_capture();
+    }
 
 
 
@@ -629,6 +1139,7 @@ void loop() {
             DEBUG_PRINTLN("Trigger pressed");
             DEBUG_PRINTLN("Starting charging");
             fire_state = charging;
+            compressor_cutoff.begin_charging(millis());
         }
     }
         // Trigger is not depressed
@@ -636,8 +1147,14 @@ void loop() {
         // Trigger has been released, fire gun
         if (fire_state == charging || fire_state == charged) {
             DEBUG_PRINTLN("Trigger released");
-            fire();
-            fire_state = idle;
+            if (ready_to_fire()) {
+                fire();
+                fire_state = idle;
+            }
+            else {
+                // Stay in the current state so the shot fires on a later pass once the valve is free
+                DEBUG_PRINTLN("Waiting for the valve to fire");
+            }
         }
             // Trigger has been released after canceling shot
         else if (fire_state == canceled) {
@@ -693,6 +1210,22 @@ void loop() {
         limiter_switch_last_state = limiter_switch_current_state;
     }
 
+    // ========== Compressor cutoff ====================================================================================
+    // Switch the compressors off early enough that the pressure settles on the target instead of overshooting it
+    if (fire_state == charging && compressor_cutoff.should_stop_charging(target_pressure)) {
+        DEBUG_PRINTLN("Target pressure reached");
+        fire_state = charged;
+        compressor_cutoff.begin_overshoot_measurement(millis());
+    }
+    if (compressor_cutoff.update_overshoot_measurement(millis(), fire_state == charged, target_pressure)) {
+        DEBUG_PRINT("Settling error (PSI): ");
+        DEBUG_PRINTLN(compressor_cutoff.settling_error());
+        DEBUG_PRINT("Time to target (ms): ");
+        DEBUG_PRINTLN(compressor_cutoff.time_to_target_ms());
+        DEBUG_PRINT("Cutoff lag (s): ");
+        DEBUG_PRINTLN(compressor_cutoff.cutoff_lag_s());
+    }
+
     // ========== Relays ===============================================================================================
     if (fire_state == charging) {
         digitalWrite(relay_A_pin, HIGH);
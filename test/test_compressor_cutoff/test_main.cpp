@@ -0,0 +1,206 @@
+//
+// Benchmarks the predictive compressor cutoff against a naive threshold cutoff on a simulated tank.
+//
+// Run with: pio test -e native
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <unity.h>
+#include <CompressorCutoff.h>
+
+
+// ========== Plant model ==============================================================================================
+// The compressors push air through a line into the tank. The flow follows the relays with a first-order lag, which is
+// what keeps the pressure rising after they switch off. Flow drops as the tank fills and as the battery drains.
+
+// Simulation step in milliseconds
+const unsigned long sim_step_ms = 1;
+// How often the controller samples the pressure, about one loop() pass
+const unsigned long loop_period_ms = 30;
+// Time constant of the flow lag in seconds
+const float plant_lag_s = 0.12;
+// Fill rate into an empty tank with a full battery in PSI/s
+const float plant_max_fill_rate = 60.0;
+// Pressure at which the compressors stall in PSI
+const float plant_stall_pressure = 180.0;
+// Pressure left in the tank after a shot in PSI
+const float plant_empty_pressure = 2.0;
+
+// Transducer calibration, same as main.cpp
+const float transducer_offset = 0.4834;
+const float transducer_max_pressure_psi = 150;
+
+struct Tank {
+    float pressure;
+    float flow;
+    // 1.0 is a full battery, compressors slow down as it drops
+    float battery;
+};
+
+void step_tank(Tank &tank, bool relays_on) {
+    float dt = sim_step_ms / 1000.0;
+    float drive = relays_on ? plant_max_fill_rate * tank.battery * (1 - tank.pressure / plant_stall_pressure) : 0;
+    tank.flow += (drive - tank.flow) * dt / plant_lag_s;
+    tank.pressure += tank.flow * dt;
+}
+
+/**
+ * Read the tank the way the Arduino does, through a 10-bit ADC.
+ */
+float read_transducer(const Tank &tank) {
+    float voltage = tank.pressure * (4.00 / transducer_max_pressure_psi) + transducer_offset;
+    int signal = (int)(voltage * 1024 / 5.00);
+    return (signal * 5.00 / 1024 - transducer_offset) * (transducer_max_pressure_psi / 4.00);
+}
+
+
+// ========== Benchmark ================================================================================================
+
+struct ChargeResult {
+    float settling_error;
+    unsigned long time_to_target_ms;
+};
+
+/**
+ * Charge the tank from empty to the target, wait for it to settle and measure how it did.
+ * @param predictive Whether to use the predictive cutoff or stop as soon as the pressure reaches the target.
+ */
+ChargeResult charge(CompressorCutoff &cutoff, Tank &tank, float target, bool predictive, unsigned long &now_ms) {
+    tank.pressure = plant_empty_pressure;
+    tank.flow = 0;
+
+    bool charging = true;
+    cutoff.begin_charging(now_ms);
+
+    while (true) {
+        if (now_ms % loop_period_ms == 0) {
+            cutoff.add_sample(read_transducer(tank), now_ms, charging);
+
+            if (charging) {
+                bool stop = predictive ? cutoff.should_stop_charging(target) : read_transducer(tank) >= target;
+                if (stop) {
+                    charging = false;
+                    cutoff.begin_overshoot_measurement(now_ms);
+                }
+            }
+            if (cutoff.update_overshoot_measurement(now_ms, !charging, target)) {
+                break;
+            }
+        }
+
+        step_tank(tank, charging);
+        now_ms += sim_step_ms;
+    }
+
+    ChargeResult result = {cutoff.settling_error(), cutoff.time_to_target_ms()};
+    return result;
+}
+
+struct BenchmarkResult {
+    float mean_abs_settling_error;
+    float worst_abs_settling_error;
+    float mean_time_to_target_ms;
+};
+
+// Charges per benchmark run. The battery drains linearly from full to battery_end over the run.
+const int charges_per_run = 20;
+const float battery_end = 0.6;
+// Charges at the start of a run while the lag is still being learned, left out of the results
+const int warmup_charges = 3;
+
+BenchmarkResult run_benchmark(bool predictive, float target) {
+    CompressorCutoff cutoff;
+    Tank tank = {plant_empty_pressure, 0, 1.0};
+    unsigned long now_ms = 0;
+
+    BenchmarkResult result = {0, 0, 0};
+    int counted = 0;
+    for (int i = 0; i < charges_per_run; i++) {
+        tank.battery = 1.0 - (1.0 - battery_end) * i / (charges_per_run - 1);
+        ChargeResult charge_result = charge(cutoff, tank, target, predictive, now_ms);
+
+        if (i < warmup_charges) {
+            continue;
+        }
+        float abs_error = fabs(charge_result.settling_error);
+        result.mean_abs_settling_error += abs_error;
+        if (abs_error > result.worst_abs_settling_error) {
+            result.worst_abs_settling_error = abs_error;
+        }
+        result.mean_time_to_target_ms += charge_result.time_to_target_ms;
+        counted++;
+    }
+    result.mean_abs_settling_error /= counted;
+    result.mean_time_to_target_ms /= counted;
+
+    printf("%-10s target %3.0f PSI: mean |settling error| %5.2f PSI, worst %5.2f PSI, mean time to target %6.0f ms\n",
+           predictive ? "predictive" : "naive", target, result.mean_abs_settling_error,
+           result.worst_abs_settling_error, result.mean_time_to_target_ms);
+    return result;
+}
+
+void check_predictive_beats_naive(float target) {
+    BenchmarkResult naive = run_benchmark(false, target);
+    BenchmarkResult predictive = run_benchmark(true, target);
+
+    TEST_ASSERT_TRUE(predictive.mean_abs_settling_error < naive.mean_abs_settling_error);
+    TEST_ASSERT_TRUE(predictive.worst_abs_settling_error < naive.worst_abs_settling_error);
+    // Within the resolution of the pressure display
+    TEST_ASSERT_TRUE(predictive.mean_abs_settling_error < 1.0);
+}
+
+void test_limited_pressure() {
+    check_predictive_beats_naive(50);
+}
+
+void test_unlimited_pressure() {
+    check_predictive_beats_naive(100);
+}
+
+
+// ========== Estimator ================================================================================================
+
+void test_fill_rate_tracks_constant_rise() {
+    CompressorCutoff cutoff;
+    cutoff.begin_charging(0);
+    for (unsigned long t = 0; t <= 1000; t += loop_period_ms) {
+        cutoff.add_sample(10 + 0.02 * t, t, true);
+    }
+    TEST_ASSERT_FLOAT_WITHIN(0.5, 20.0, cutoff.fill_rate());
+}
+
+void test_begin_charging_forgets_shot() {
+    CompressorCutoff cutoff;
+    cutoff.begin_charging(0);
+    cutoff.add_sample(100, 0, false);
+    // A shot empties the tank between two samples
+    cutoff.add_sample(2, 30, false);
+    TEST_ASSERT_TRUE(cutoff.fill_rate() < 0);
+
+    cutoff.begin_charging(30);
+    cutoff.add_sample(2, 30, true);
+    cutoff.add_sample(3, 60, true);
+    TEST_ASSERT_FLOAT_WITHIN(0.5, 33.3, cutoff.fill_rate());
+}
+
+void test_falling_samples_ignored_while_charging() {
+    CompressorCutoff cutoff;
+    cutoff.begin_charging(0);
+    cutoff.add_sample(10, 0, true);
+    cutoff.add_sample(11, 30, true);
+    float rate = cutoff.fill_rate();
+    cutoff.add_sample(10.8, 60, true);
+    TEST_ASSERT_EQUAL_FLOAT(rate, cutoff.fill_rate());
+}
+
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_fill_rate_tracks_constant_rise);
+    RUN_TEST(test_begin_charging_forgets_shot);
+    RUN_TEST(test_falling_samples_ignored_while_charging);
+    RUN_TEST(test_limited_pressure);
+    RUN_TEST(test_unlimited_pressure);
+    return UNITY_END();
+}